@@ -34,6 +34,9 @@
 
 #pragma pack(1)
 
+#define HPSA_INQUIRY 0x12
+#define HPSA_VPD_UNIT_SERIAL_NUMBER 0x80
+
 #define BMIC_READ 0x26
 #define BMIC_WRITE 0x27
 
@@ -46,6 +49,7 @@
 #define PRODUCT_ID_LEN 16
 #define SOFTWARE_NAME_LEN 64
 #define HARDWARE_NAME_LEN 32
+#define SERIAL_NUMBER_LEN 32
 #define MAX_STR_BUF_LEN SOFTWARE_NAME_LEN
 
 struct bmic_identify_controller {
@@ -200,5 +204,14 @@ struct bmic_controller_parameters {
 
 #define NVRAM_FLAG_HBA_MODE_ENABLED (1 << 3)
 
+/* Standard SCSI VPD page 0x80, as returned for the controller LUN. */
+struct vpd_unit_serial_number {
+	u8 peripheral;
+	u8 page_code;
+	u8 reserved;
+	u8 page_length;
+	char serial_number[SERIAL_NUMBER_LEN];
+};
+
 #pragma pack()
 #endif /* HPSAHBA_HPSA_H */
@@ -30,18 +30,37 @@
 #include <string.h>
 #include <ctype.h>
 #include <stdbool.h>
+#include <time.h>
 
 #include <unistd.h>
 #include <fcntl.h>
 
 #include <endian.h>
+#include <sys/file.h>
 #include <sys/ioctl.h>
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <sys/wait.h>
 #include <linux/cciss_ioctl.h>
 
 #include "hpsa.h"
 
 static const char *const hpsahba_version = "0.0.0";
 
+/* Machine-wide list of controllers allowed to change without asking. */
+#define CONFIRM_POLICY_PATH "/etc/hpsahba/confirm"
+
+/*
+ * Lock files shared with other tools sending commands to the controller:
+ * LOCK_DIR/hpsahba-<PCI address>.lock, flock(LOCK_SH) for reading and
+ * flock(LOCK_EX) for changing controller parameters. Directory and files are
+ * accessible only by root, so other users can not hold the lock.
+ */
+#define LOCK_DIR "/run/hpsahba"
+
+/* Default poll interval for exporter, in seconds. */
+#define DEFAULT_EXPORT_INTERVAL 60
+
 __attribute__((format(printf, 1, 2)))
 __attribute__((noreturn))
 static void really_die(const char *format, ...)
@@ -63,6 +82,14 @@ static void really_die(const char *format, ...)
 	die("%s: " format, path, ##__VA_ARGS__)
 #define die_dev_errno(path, format, ...) \
 	die_dev(path, format ": %d %s", ##__VA_ARGS__, errno, strerror(errno))
+#define die_file_line(path, line_num, format, ...) \
+	die("%s:%u: " format, path, line_num, ##__VA_ARGS__)
+
+/* For errors which long-running modes survive. */
+#define warn_dev(path, format, ...) \
+	fprintf(stderr, "%s: " format "\n", path, ##__VA_ARGS__)
+#define warn_dev_errno(path, format, ...) \
+	warn_dev(path, format ": %d %s", ##__VA_ARGS__, errno, strerror(errno))
 
 static void print_help(const char *exe_name)
 {
@@ -76,6 +103,9 @@ static void print_help(const char *exe_name)
 		"\t%s -i /dev/sgN\n"
 		"\t%s -E /dev/sgN\n"
 		"\t%s -d /dev/sgN\n"
+		"\t%s -a PLAN_PATH /dev/sgN...\n"
+		"\t%s -w INTERVAL /dev/sgN\n"
+		"\t%s -p OUTPUT_PATH [-n INTERVAL] /dev/sgN...\n"
 		"\n"
 		"Options:\n"
 		"\t-h\n"
@@ -91,9 +121,32 @@ static void print_help(const char *exe_name)
 		"\t\tEnable HBA mode on controller.\n"
 		"\n"
 		"\t-d <device path>\n"
-		"\t\tDisable HBA mode on controller.\n",
+		"\t\tDisable HBA mode on controller.\n"
+		"\n"
+		"\t-a <plan path> <device path>...\n"
+		"\t\tApply HBA mode from plan file to listed controllers,\n"
+		"\t\tskipping controllers already in the desired mode.\n"
+		"\n"
+		"\t-w <interval> <device path>\n"
+		"\t\tPoll controller every <interval> seconds and print\n"
+		"\t\tinformation fields only when they change.\n"
+		"\n"
+		"\t-p <output path> <device path>...\n"
+		"\t\tPoll listed controllers and write metrics in Prometheus\n"
+		"\t\ttext format into <output path>.\n"
+		"\n"
+		"\t-n <interval>\n"
+		"\t\tPoll interval for -p in seconds, default is %d.\n"
+		"\n"
+		"\t-c <board id>:<serial number>\n"
+		"\t\tConfirm HBA mode change on controller with given board ID\n"
+		"\t\tand serial number without asking, may be repeated.\n"
+		"\t\tControllers listed in " CONFIRM_POLICY_PATH " are\n"
+		"\t\tconfirmed too.\n",
 		hpsahba_version,
-		exe_name, exe_name, exe_name, exe_name, exe_name);
+		exe_name, exe_name, exe_name, exe_name, exe_name, exe_name,
+		exe_name, exe_name,
+		DEFAULT_EXPORT_INTERVAL);
 }
 
 static void print_version()
@@ -243,28 +296,98 @@ static void print_cmd_error(const ErrorInfo_struct *info)
 	fputc('\n', stderr);
 }
 
-static void really_exec_cmd(const char *path, int fd, uint8_t cmd_num,
-	const char *cmd_name, void *buf, size_t size)
+static void fill_inquiry_cmd(IOCTL_Command_struct *cmd, uint8_t page,
+	void *buf, size_t size)
+{
+	assert(size <= UINT8_MAX);
+
+	cmd->Request.CDB[0] = HPSA_INQUIRY;
+	/* EVPD bit: request vital product data page. */
+	cmd->Request.CDB[1] = 0x01;
+	cmd->Request.CDB[2] = page;
+	cmd->Request.CDB[4] = size;
+	cmd->Request.CDBLen = 6;
+
+	cmd->buf_size = size;
+	cmd->buf = buf;
+
+	cmd->Request.Type.Type = TYPE_CMD;
+	cmd->Request.Type.Attribute = ATTR_SIMPLE;
+	cmd->Request.Type.Direction = XFER_READ;
+	cmd->Request.Timeout = 0;
+}
+
+/* Returns 0 on success or -1 if command failed, reason is printed. */
+static int try_submit_cmd(const char *path, int fd, IOCTL_Command_struct *cmd,
+	const char *cmd_name, int allow_underrun)
 {
 	int rc;
-	IOCTL_Command_struct cmd = {{{0}}, {0}, {0}, 0, 0};
+	uint16_t status;
 
-	fill_cmd(&cmd, cmd_num, buf, size);
-	rc = ioctl(fd, CCISS_PASSTHRU, &cmd);
-	if (rc)
-		die_dev_errno(path,
+	rc = ioctl(fd, CCISS_PASSTHRU, cmd);
+	if (rc) {
+		warn_dev_errno(path,
 			"ioctl(CCISS_PASSTHRU) failed with command "
 			"%s, rc == %d", cmd_name, rc);
+		return -1;
+	}
 
-	if (cmd.error_info.CommandStatus) {
-		print_cmd_error(&cmd.error_info);
-		die_dev(path, "Command %s failed", cmd_name);
+	status = cmd->error_info.CommandStatus;
+	if (allow_underrun && status == CMD_DATA_UNDERRUN)
+		status = CMD_SUCCESS;
+	if (status) {
+		print_cmd_error(&cmd->error_info);
+		return -1;
 	}
+
+	return 0;
+}
+
+static void submit_cmd(const char *path, int fd, IOCTL_Command_struct *cmd,
+	const char *cmd_name, int allow_underrun)
+{
+	if (try_submit_cmd(path, fd, cmd, cmd_name, allow_underrun))
+		die_dev(path, "Command %s failed", cmd_name);
+}
+
+static void really_exec_cmd(const char *path, int fd, uint8_t cmd_num,
+	const char *cmd_name, void *buf, size_t size)
+{
+	IOCTL_Command_struct cmd = {{{0}}, {0}, {0}, 0, 0};
+
+	fill_cmd(&cmd, cmd_num, buf, size);
+	submit_cmd(path, fd, &cmd, cmd_name, 0);
 }
 
 #define exec_cmd(path, fd, cmd, buf, size) \
 	really_exec_cmd(path, fd, cmd, #cmd, buf, size)
 
+static int really_try_exec_cmd(const char *path, int fd, uint8_t cmd_num,
+	const char *cmd_name, void *buf, size_t size)
+{
+	IOCTL_Command_struct cmd = {{{0}}, {0}, {0}, 0, 0};
+
+	fill_cmd(&cmd, cmd_num, buf, size);
+	return try_submit_cmd(path, fd, &cmd, cmd_name, 0);
+}
+
+#define try_exec_cmd(path, fd, cmd, buf, size) \
+	really_try_exec_cmd(path, fd, cmd, #cmd, buf, size)
+
+/* VPD pages are optional, so failure is not fatal here. */
+static int really_try_exec_inquiry(const char *path, int fd, uint8_t page,
+	const char *page_name, void *buf, size_t size)
+{
+	IOCTL_Command_struct cmd = {{{0}}, {0}, {0}, 0, 0};
+
+	/* Short VPD pages are reported as underrun, this is expected. */
+	fill_inquiry_cmd(&cmd, page, buf, size);
+	return try_submit_cmd(path, fd, &cmd, page_name, 1);
+}
+
+#define try_exec_inquiry(path, fd, page, buf, size) \
+	really_try_exec_inquiry(path, fd, page, #page, buf, size)
+
 static void identify_controller(const char *path, int fd,
 	struct bmic_identify_controller *controller_id)
 {
@@ -272,6 +395,13 @@ static void identify_controller(const char *path, int fd,
 		sizeof(*controller_id));
 }
 
+static int try_identify_controller(const char *path, int fd,
+	struct bmic_identify_controller *controller_id)
+{
+	return try_exec_cmd(path, fd, BMIC_IDENTIFY_CONTROLLER, controller_id,
+		sizeof(*controller_id));
+}
+
 static int is_hba_mode_supported(
 	const struct bmic_identify_controller *controller_id)
 {
@@ -279,6 +409,144 @@ static int is_hba_mode_supported(
 	return (f & YET_MORE_CTLR_FLAG_HBA_MODE_SUPP) ? 1 : 0;
 }
 
+static int inquiry_serial_number(const char *path, int fd,
+	struct vpd_unit_serial_number *serial)
+{
+	return try_exec_inquiry(path, fd, HPSA_VPD_UNIT_SERIAL_NUMBER, serial,
+		sizeof(*serial));
+}
+
+/* "dddd:bb:dd.f" */
+#define PCI_ADDRESS_LEN 12
+
+/* Returns 0 on success or -1 on failure, reason is printed. */
+static int try_get_pci_address(const char *path, int fd, char *buf,
+	size_t size)
+{
+	cciss_pci_info_struct pci_info = {0, 0, 0, 0};
+	int rc = ioctl(fd, CCISS_GETPCIINFO, &pci_info);
+	if (rc) {
+		warn_dev_errno(path,
+			"ioctl(CCISS_GETPCIINFO) failed, rc == %d", rc);
+		return -1;
+	}
+
+	snprintf(buf, size, "%04x:%02x:%02x.%x",
+		pci_info.domain, pci_info.bus,
+		pci_info.dev_fn >> 3, pci_info.dev_fn & 0x7);
+	return 0;
+}
+
+/* Returns lock file descriptor or -1 on failure, reason is printed. */
+static int check_lock_dir(const char *path)
+{
+	struct stat st;
+
+	if (mkdir(LOCK_DIR, 0755) && errno != EEXIST) {
+		warn_dev_errno(path, "Unable to create lock directory %s",
+			LOCK_DIR);
+		return -1;
+	}
+	if (lstat(LOCK_DIR, &st)) {
+		warn_dev_errno(path, "lstat() failed on %s", LOCK_DIR);
+		return -1;
+	}
+	if (!S_ISDIR(st.st_mode) || st.st_uid != 0 ||
+			(st.st_mode & (S_IWGRP | S_IWOTH))) {
+		warn_dev(path, "%s must be a directory owned by root and not "
+			"writable by group or others", LOCK_DIR);
+		return -1;
+	}
+
+	return 0;
+}
+
+static int try_lock_controller(const char *path, int fd, int exclusive)
+{
+	char pci_address[PCI_ADDRESS_LEN + 1];
+	char lock_path[sizeof(LOCK_DIR "/hpsahba-.lock") + PCI_ADDRESS_LEN];
+	int operation = exclusive ? LOCK_EX : LOCK_SH;
+	int lock_fd;
+	struct stat st;
+
+	if (try_get_pci_address(path, fd, pci_address, sizeof(pci_address)))
+		return -1;
+	if (check_lock_dir(path))
+		return -1;
+	snprintf(lock_path, sizeof(lock_path), LOCK_DIR "/hpsahba-%s.lock",
+		pci_address);
+
+	lock_fd = open(lock_path, O_RDONLY | O_CREAT | O_NOFOLLOW | O_CLOEXEC,
+		0600);
+	if (lock_fd == -1) {
+		warn_dev_errno(path, "Unable to open lock file %s", lock_path);
+		return -1;
+	}
+
+	/* flock() needs only read access, so nobody else may open it. */
+	if (fstat(lock_fd, &st)) {
+		warn_dev_errno(path, "fstat() failed on %s", lock_path);
+		close(lock_fd);
+		return -1;
+	}
+	if (!S_ISREG(st.st_mode) || st.st_uid != 0 ||
+			(st.st_mode & (S_IRWXG | S_IRWXO))) {
+		warn_dev(path, "Lock file %s must be a regular file owned by "
+			"root and accessible only by owner",
+			lock_path);
+		close(lock_fd);
+		return -1;
+	}
+
+	if (flock(lock_fd, operation | LOCK_NB)) {
+		if (errno != EWOULDBLOCK)
+			goto err;
+
+		fprintf(stderr, "%s: Waiting for lock %s\n", path, lock_path);
+		while (flock(lock_fd, operation))
+			if (errno != EINTR)
+				goto err;
+	}
+
+	return lock_fd;
+
+err:
+	warn_dev_errno(path, "flock() failed on %s", lock_path);
+	close(lock_fd);
+	return -1;
+}
+
+static int lock_controller(const char *path, int fd, int exclusive)
+{
+	int lock_fd = try_lock_controller(path, fd, exclusive);
+	if (lock_fd == -1)
+		die_dev(path, "Unable to lock controller");
+	return lock_fd;
+}
+
+/*
+ * Read-only commands can not break anything, so they are sent even if the
+ * lock is unavailable (for example, no /run in initramfs). Returns -1 then,
+ * which unlock_controller() accepts.
+ */
+static int lock_controller_shared(const char *path, int fd)
+{
+	int lock_fd = try_lock_controller(path, fd, 0);
+	if (lock_fd == -1)
+		warn_dev(path, "Reading controller without lock");
+	return lock_fd;
+}
+
+static void unlock_controller(const char *path, int lock_fd)
+{
+	if (lock_fd == -1)
+		return;
+
+	/* Closing the only descriptor releases the lock. */
+	if (close(lock_fd))
+		die_dev_errno(path, "close() failed on lock file");
+}
+
 static void sense_controller_parameters(const char *path, int fd,
 	struct bmic_controller_parameters *controller_params)
 {
@@ -286,6 +554,13 @@ static void sense_controller_parameters(const char *path, int fd,
 		sizeof(*controller_params));
 }
 
+static int try_sense_controller_parameters(const char *path, int fd,
+	struct bmic_controller_parameters *controller_params)
+{
+	return try_exec_cmd(path, fd, BMIC_SENSE_CONTROLLER_PARAMETERS,
+		controller_params, sizeof(*controller_params));
+}
+
 static void set_controller_parameters(const char *path, int fd,
 	struct bmic_controller_parameters *controller_params)
 {
@@ -322,58 +597,668 @@ static const char *trim(char *str)
 	return str;
 }
 
-static void print_info_str_buf(const char *var_name, const char *str_buf,
-	size_t max_str_len)
+/* Copy fixed-size string field into dst[max_str_len + 1], trimmed. */
+static void copy_str_buf(char *dst, const char *str_buf, size_t max_str_len)
 {
 	/* Ensure that string is null-terminated. */
 	char str[MAX_STR_BUF_LEN + 1] = {0};
 	strncpy(str, str_buf, max_str_len);
-	printf("%s='%s'\n", var_name, trim(str));
+	strcpy(dst, trim(str));
+}
+
+#define MAX_INFO_FIELDS 32
+/* Quoted string. */
+#define MAX_INFO_VALUE_LEN (MAX_STR_BUF_LEN + 2)
+
+/* Decoded controller state, fields are always added in the same order. */
+struct info {
+	size_t num_fields;
+	struct {
+		const char *var_name;
+		char value[MAX_INFO_VALUE_LEN + 1];
+	} fields[MAX_INFO_FIELDS];
+};
+
+__attribute__((format(printf, 3, 4)))
+static void add_info(struct info *info, const char *var_name,
+	const char *format, ...)
+{
+	va_list args;
+
+	assert(info->num_fields < MAX_INFO_FIELDS);
+	info->fields[info->num_fields].var_name = var_name;
+
+	va_start(args, format);
+	vsnprintf(info->fields[info->num_fields].value,
+		sizeof(info->fields[info->num_fields].value), format, args);
+	va_end(args);
+
+	info->num_fields++;
+}
+
+static void add_info_str_buf(struct info *info, const char *var_name,
+	const char *str_buf, size_t max_str_len)
+{
+	char str[MAX_STR_BUF_LEN + 1];
+	copy_str_buf(str, str_buf, max_str_len);
+	add_info(info, var_name, "'%s'", str);
+}
+
+static void add_info_fw_rev(struct info *info, const char *var_name,
+	const char *rev_buf)
+{
+	add_info_str_buf(info, var_name, rev_buf, FIRMWARE_REV_LEN);
+}
+
+
+/* Everything a plan entry may use to select a controller. */
+struct controller_keys {
+	uint32_t board_id;
+	char pci_address[PCI_ADDRESS_LEN + 1];
+	char serial_number[SERIAL_NUMBER_LEN + 1];
+};
+
+/* Returns 0 on success or -1 on failure, reason is printed. */
+static int try_get_controller_keys(const char *path, int fd,
+	const struct bmic_identify_controller *controller_id,
+	struct controller_keys *keys)
+{
+	struct vpd_unit_serial_number serial = {0};
+	size_t serial_len;
+
+	keys->board_id = le32toh(controller_id->board_id);
+	if (try_get_pci_address(path, fd, keys->pci_address,
+			sizeof(keys->pci_address)))
+		return -1;
+
+	/* Empty serial number never matches confirmation tokens. */
+	if (inquiry_serial_number(path, fd, &serial)) {
+		warn_dev(path, "Unable to read serial number");
+		serial_len = 0;
+	} else {
+		serial_len = serial.page_length;
+		if (serial_len > SERIAL_NUMBER_LEN)
+			serial_len = SERIAL_NUMBER_LEN;
+	}
+	copy_str_buf(keys->serial_number, serial.serial_number, serial_len);
+	return 0;
+}
+
+static void get_controller_keys(const char *path, int fd,
+	const struct bmic_identify_controller *controller_id,
+	struct controller_keys *keys)
+{
+	if (try_get_controller_keys(path, fd, controller_id, keys))
+		die_dev(path, "Unable to get controller keys");
+}
+
+struct confirm_token {
+	uint32_t board_id;
+	char serial_number[SERIAL_NUMBER_LEN + 1];
+};
+
+struct confirm_tokens {
+	struct confirm_token *tokens;
+	size_t num_tokens;
+};
+
+/* Returns 0 on success or -1 if token is malformed. */
+static int parse_confirm_token(const char *str, struct confirm_token *token)
+{
+	const char *serial_number = strchr(str, ':');
+	char *end;
+	unsigned long board_id;
+
+	if (serial_number == NULL)
+		return -1;
+
+	errno = 0;
+	board_id = strtoul(str, &end, 16);
+	if (errno || end == str || end != serial_number ||
+			board_id > UINT32_MAX)
+		return -1;
+
+	serial_number++;
+	if (!*serial_number || strlen(serial_number) > SERIAL_NUMBER_LEN)
+		return -1;
+
+	token->board_id = board_id;
+	strcpy(token->serial_number, serial_number);
+	return 0;
 }
 
-static void print_info_fw_rev(const char *var_name, const char *rev_buf)
+static void add_confirm_token(struct confirm_tokens *tokens,
+	const struct confirm_token *token)
+{
+	tokens->tokens = realloc(tokens->tokens,
+		(tokens->num_tokens + 1) * sizeof(*tokens->tokens));
+	if (tokens->tokens == NULL)
+		die("Out of memory");
+	tokens->tokens[tokens->num_tokens++] = *token;
+}
+
+#define CONF_DELIMITERS " \t\r\n"
+
+static void strip_comment(char *line)
 {
-	print_info_str_buf(var_name, rev_buf, FIRMWARE_REV_LEN);
+	char *comment = strchr(line, '#');
+	if (comment != NULL)
+		*comment = '\0';
+}
+
+static void read_confirm_policy(struct confirm_tokens *tokens)
+{
+	const char *path = CONFIRM_POLICY_PATH;
+	FILE *file;
+	struct stat st;
+	char *line = NULL;
+	size_t line_size = 0;
+	unsigned int line_num = 0;
+
+	file = fopen(path, "r");
+	if (file == NULL) {
+		if (errno == ENOENT)
+			return;
+		die_errno("%s: Unable to open policy file", path);
+	}
+
+	/* Anyone able to write there would be able to skip confirmation. */
+	if (fstat(fileno(file), &st))
+		die_errno("%s: fstat() failed", path);
+	if (st.st_uid != 0 || (st.st_mode & (S_IWGRP | S_IWOTH)))
+		die("%s: Policy file must be owned by root and must not be "
+			"writable by group or others",
+			path);
+
+	while (getline(&line, &line_size, file) != -1) {
+		struct confirm_token token;
+		char *str;
+		char *saveptr;
+
+		line_num++;
+
+		strip_comment(line);
+		str = strtok_r(line, CONF_DELIMITERS, &saveptr);
+		while (str != NULL) {
+			if (parse_confirm_token(str, &token))
+				die_file_line(path, line_num,
+					"Invalid confirmation token: '%s'",
+					str);
+			add_confirm_token(tokens, &token);
+			str = strtok_r(NULL, CONF_DELIMITERS, &saveptr);
+		}
+	}
+	if (ferror(file))
+		die_errno("%s: Unable to read policy file", path);
+
+	free(line);
+	fclose(file);
+}
+
+static int is_change_confirmed(const struct confirm_tokens *tokens,
+	const char *path, const struct controller_keys *keys)
+{
+	for (size_t i = 0; i < tokens->num_tokens; i++) {
+		const struct confirm_token *token = &tokens->tokens[i];
+
+		/* Empty serial number is never accepted by parser. */
+		if (token->board_id == keys->board_id &&
+				!strcmp(token->serial_number,
+					keys->serial_number)) {
+			fprintf(stderr,
+				"%s: HBA mode change confirmed for "
+				"0x%08x:%s\n",
+				path, keys->board_id, keys->serial_number);
+			return 1;
+		}
+	}
+
+	return 0;
+}
+
+static void collect_info(struct info *info,
+	const struct bmic_identify_controller *controller_id,
+	const struct bmic_controller_parameters *controller_params,
+	const struct controller_keys *keys)
+{
+	int hba_mode_supported;
+	int hba_mode_enabled = 0;
+
+	info->num_fields = 0;
+
+	add_info_str_buf(info, "VENDOR_ID",
+		controller_id->vendor_id, VENDOR_ID_LEN);
+	add_info_str_buf(info, "PRODUCT_ID",
+		controller_id->product_id, PRODUCT_ID_LEN);
+	add_info(info, "BOARD_ID", "'0x%08x'",
+		keys->board_id);
+	add_info(info, "PCI_ADDRESS", "'%s'",
+		keys->pci_address);
+	add_info(info, "SERIAL_NUMBER", "'%s'",
+		keys->serial_number);
+	add_info_str_buf(info, "SOFTWARE_NAME",
+		controller_params->software_name, SOFTWARE_NAME_LEN);
+	add_info_str_buf(info, "HARDWARE_NAME",
+		controller_params->hardware_name, HARDWARE_NAME_LEN);
+	add_info_fw_rev(info, "RUNNING_FIRM_REV",
+		controller_id->running_firm_rev);
+	add_info_fw_rev(info, "ROM_FIRM_REV",
+		controller_id->rom_firm_rev);
+	add_info_fw_rev(info, "REC_ROM_INACTIVE_REV",
+		controller_id->rec_rom_inactive_rev);
+	add_info(info, "YET_MORE_CONTROLLER_FLAGS", "'0x%08x'",
+		le32toh(controller_id->yet_more_controller_flags));
+	add_info(info, "NVRAM_FLAGS", "'0x%02x'",
+		controller_params->nvram_flags);
+	add_info(info, "CACHE_NVRAM_FLAGS", "'0x%02x'",
+		controller_params->cache_nvram_flags);
+	add_info(info, "PERCENT_WRITE_CACHE", "%u",
+		controller_id->percent_write_cache);
+	add_info(info, "DAUGHTER_BOARD_CACHE_SIZE", "%u",
+		le16toh(controller_id->daughter_board_cache_size));
+	add_info(info, "TOTAL_MEMORY_SIZE", "%u",
+		le16toh(controller_id->total_memory_size));
+	add_info(info, "CACHE_BATTERY_COUNT", "%u",
+		controller_id->cache_battery_count);
+	add_info(info, "LAST_LOCKUP", "'0x%02x'",
+		controller_id->last_lockup);
+	add_info(info, "TEMP_WARNING_LEVEL", "%u",
+		controller_params->temp_warning_level);
+	add_info(info, "TEMP_SHUTDOWN_LEVEL", "%u",
+		controller_params->temp_shutdown_level);
+	add_info(info, "TEMP_CONDITION_RESET", "%u",
+		controller_params->temp_condition_reset);
+
+	hba_mode_supported = is_hba_mode_supported(controller_id);
+	if (hba_mode_supported)
+		hba_mode_enabled = is_hba_mode_enabled(controller_params);
+	add_info(info, "HBA_MODE_SUPPORTED", "%d",
+		hba_mode_supported);
+	add_info(info, "HBA_MODE_ENABLED", "%d",
+		hba_mode_enabled);
 }
 
 static void print_info(const char *path, int fd)
 {
 	struct bmic_identify_controller controller_id = {0};
 	struct bmic_controller_parameters controller_params = {0};
-	int hba_mode_supported;
-	int hba_mode_enabled = 0;
+	struct controller_keys keys;
+	struct info info;
+	int lock_fd;
 
+	lock_fd = lock_controller_shared(path, fd);
 	identify_controller(path, fd, &controller_id);
 	sense_controller_parameters(path, fd, &controller_params);
+	get_controller_keys(path, fd, &controller_id, &keys);
+	unlock_controller(path, lock_fd);
 
-	print_info_str_buf("VENDOR_ID",
-		controller_id.vendor_id, VENDOR_ID_LEN);
-	print_info_str_buf("PRODUCT_ID",
-		controller_id.product_id, PRODUCT_ID_LEN);
-	printf("BOARD_ID='0x%08x'\n",
-		le32toh(controller_id.board_id));
-	print_info_str_buf("SOFTWARE_NAME",
-		controller_params.software_name, SOFTWARE_NAME_LEN);
-	print_info_str_buf("HARDWARE_NAME",
-		controller_params.hardware_name, HARDWARE_NAME_LEN);
-	print_info_fw_rev("RUNNING_FIRM_REV",
-		controller_id.running_firm_rev);
-	print_info_fw_rev("ROM_FIRM_REV",
-		controller_id.rom_firm_rev);
-	print_info_fw_rev("REC_ROM_INACTIVE_REV",
-		controller_id.rec_rom_inactive_rev);
-	printf("YET_MORE_CONTROLLER_FLAGS='0x%08x'\n",
-		le32toh(controller_id.yet_more_controller_flags));
-	printf("NVRAM_FLAGS='0x%02x'\n",
-		controller_params.nvram_flags);
-
-	hba_mode_supported = is_hba_mode_supported(&controller_id);
-	if (hba_mode_supported)
-		hba_mode_enabled = is_hba_mode_enabled(&controller_params);
-	printf("HBA_MODE_SUPPORTED=%d\n",
-		hba_mode_supported);
-	printf("HBA_MODE_ENABLED=%d\n",
-		hba_mode_enabled);
+	collect_info(&info, &controller_id, &controller_params, &keys);
+	for (size_t i = 0; i < info.num_fields; i++)
+		printf("%s=%s\n", info.fields[i].var_name,
+			info.fields[i].value);
+}
+
+static void print_timestamp()
+{
+	char buf[32];
+	time_t now = time(NULL);
+	struct tm tm;
+
+	localtime_r(&now, &tm);
+	strftime(buf, sizeof(buf), "%Y-%m-%dT%H:%M:%S%z", &tm);
+	printf("%s ", buf);
+}
+
+/*
+ * One round of commands for polling modes. Failure is not fatal, caller
+ * skips this poll and tries again later. Keys do not change, so they are
+ * read only until the first success.
+ */
+static int poll_controller(const char *path, int fd,
+	struct bmic_identify_controller *controller_id,
+	struct bmic_controller_parameters *controller_params,
+	struct controller_keys *keys, int *keys_valid)
+{
+	int lock_fd;
+	int rc;
+
+	lock_fd = lock_controller_shared(path, fd);
+	rc = try_identify_controller(path, fd, controller_id);
+	if (!rc && !*keys_valid) {
+		rc = try_get_controller_keys(path, fd, controller_id, keys);
+		*keys_valid = !rc;
+	}
+	if (!rc)
+		rc = try_sense_controller_parameters(path, fd,
+			controller_params);
+
+	unlock_controller(path, lock_fd);
+	return rc;
+}
+
+/*
+ * Print all fields once, then only fields which changed since last poll.
+ * POLL_OK is printed when polls start or stop failing.
+ */
+static void watch_info(const char *path, int fd, unsigned int interval)
+{
+	struct bmic_identify_controller controller_id = {0};
+	struct bmic_controller_parameters controller_params = {0};
+	struct controller_keys keys;
+	int keys_valid = 0;
+	int poll_ok;
+	int prev_poll_ok = -1;
+	struct info infos[2];
+	struct info *prev_info = NULL;
+	struct info *info = &infos[0];
+
+	for (;;) {
+		poll_ok = !poll_controller(path, fd, &controller_id,
+			&controller_params, &keys, &keys_valid);
+		if (poll_ok != prev_poll_ok) {
+			print_timestamp();
+			printf("POLL_OK=%d\n", poll_ok);
+			fflush(stdout);
+			prev_poll_ok = poll_ok;
+		}
+		if (!poll_ok) {
+			sleep(interval);
+			continue;
+		}
+
+		collect_info(info, &controller_id, &controller_params, &keys);
+		for (size_t i = 0; i < info->num_fields; i++) {
+			if (prev_info != NULL && !strcmp(info->fields[i].value,
+					prev_info->fields[i].value))
+				continue;
+			print_timestamp();
+			printf("%s=%s\n", info->fields[i].var_name,
+				info->fields[i].value);
+		}
+		fflush(stdout);
+
+		prev_info = info;
+		info = (info == &infos[0]) ? &infos[1] : &infos[0];
+
+		sleep(interval);
+	}
+}
+
+static unsigned int parse_interval(const char *str)
+{
+	char *end;
+	unsigned long interval;
+
+	errno = 0;
+	interval = strtoul(str, &end, 10);
+	if (errno || end == str || *end || interval == 0 ||
+			interval > UINT32_MAX)
+		die("Invalid interval: '%s', try running with -h", str);
+	return interval;
+}
+
+enum metric {
+	METRIC_HBA_MODE_SUPPORTED,
+	METRIC_HBA_MODE_ENABLED,
+	METRIC_NVRAM_FLAGS,
+	METRIC_PERCENT_WRITE_CACHE,
+	METRIC_CACHE_BATTERY_COUNT,
+	METRIC_TOTAL_MEMORY_SIZE,
+	METRIC_LAST_LOCKUP,
+	METRIC_TEMP_WARNING_LEVEL,
+	METRIC_TEMP_SHUTDOWN_LEVEL,
+	METRIC_TEMP_CONDITION_RESET,
+
+	NUM_METRICS,
+};
+
+static const struct {
+	const char *name;
+	const char *help;
+} metrics[NUM_METRICS] = {
+	[METRIC_HBA_MODE_SUPPORTED] = {"hpsahba_hba_mode_supported",
+		"Whether controller supports HBA mode."},
+	[METRIC_HBA_MODE_ENABLED] = {"hpsahba_hba_mode_enabled",
+		"Whether HBA mode is enabled in controller NVRAM."},
+	[METRIC_NVRAM_FLAGS] = {"hpsahba_nvram_flags",
+		"Raw NVRAM flags from controller parameters."},
+	[METRIC_PERCENT_WRITE_CACHE] = {"hpsahba_percent_write_cache",
+		"Percent of memory allocated to write cache."},
+	[METRIC_CACHE_BATTERY_COUNT] = {"hpsahba_cache_battery_count",
+		"Number of cache batteries."},
+	[METRIC_TOTAL_MEMORY_SIZE] = {"hpsahba_total_memory_size",
+		"Total size of attached memory, MB."},
+	[METRIC_LAST_LOCKUP] = {"hpsahba_last_lockup",
+		"Last lockup code."},
+	[METRIC_TEMP_WARNING_LEVEL] = {"hpsahba_temp_warning_level",
+		"Temperature warning level from controller parameters."},
+	[METRIC_TEMP_SHUTDOWN_LEVEL] = {"hpsahba_temp_shutdown_level",
+		"Temperature shutdown level from controller parameters."},
+	[METRIC_TEMP_CONDITION_RESET] = {"hpsahba_temp_condition_reset",
+		"Temperature condition reset level from controller parameters."},
+};
+
+struct export_target {
+	const char *path;
+	int fd;
+	struct controller_keys keys;
+	int keys_valid;
+	struct bmic_identify_controller controller_id;
+	struct bmic_controller_parameters controller_params;
+	int up;
+};
+
+static void collect_metrics(unsigned long values[NUM_METRICS],
+	const struct bmic_identify_controller *controller_id,
+	const struct bmic_controller_parameters *controller_params)
+{
+	int hba_mode_supported = is_hba_mode_supported(controller_id);
+
+	values[METRIC_HBA_MODE_SUPPORTED] = hba_mode_supported;
+	values[METRIC_HBA_MODE_ENABLED] = hba_mode_supported ?
+		is_hba_mode_enabled(controller_params) : 0;
+	values[METRIC_NVRAM_FLAGS] = controller_params->nvram_flags;
+	values[METRIC_PERCENT_WRITE_CACHE] =
+		controller_id->percent_write_cache;
+	values[METRIC_CACHE_BATTERY_COUNT] =
+		controller_id->cache_battery_count;
+	values[METRIC_TOTAL_MEMORY_SIZE] =
+		le16toh(controller_id->total_memory_size);
+	values[METRIC_LAST_LOCKUP] = controller_id->last_lockup;
+	values[METRIC_TEMP_WARNING_LEVEL] =
+		controller_params->temp_warning_level;
+	values[METRIC_TEMP_SHUTDOWN_LEVEL] =
+		controller_params->temp_shutdown_level;
+	values[METRIC_TEMP_CONDITION_RESET] =
+		controller_params->temp_condition_reset;
+}
+
+/* Label values are quoted, backslash, quote and newline are escaped. */
+static void fprint_label(FILE *file, const char *name, const char *value)
+{
+	fprintf(file, "%s=\"", name);
+	for (; *value; value++) {
+		if (*value == '\\' || *value == '"')
+			fputc('\\', file);
+		if (*value == '\n')
+			fputs("\\n", file);
+		else
+			fputc(*value, file);
+	}
+	fputc('"', file);
+}
+
+static void fprint_target_labels(FILE *file,
+	const struct export_target *target)
+{
+	char board_id[sizeof("0x00000000")] = "";
+
+	/* Keys stay empty until the controller answers for the first time. */
+	if (target->keys_valid)
+		snprintf(board_id, sizeof(board_id), "0x%08x",
+			target->keys.board_id);
+
+	fprint_label(file, "device", target->path);
+	fputc(',', file);
+	fprint_label(file, "pci_address", target->keys.pci_address);
+	fputc(',', file);
+	fprint_label(file, "board_id", board_id);
+	fputc(',', file);
+	fprint_label(file, "serial_number", target->keys.serial_number);
+}
+
+static void fprint_info_metric(FILE *file,
+	const struct export_target targets[], size_t num_targets)
+{
+	fputs("# HELP hpsahba_controller_info Controller identification.\n"
+		"# TYPE hpsahba_controller_info gauge\n",
+		file);
+
+	for (size_t i = 0; i < num_targets; i++) {
+		const struct bmic_identify_controller *controller_id =
+			&targets[i].controller_id;
+		char str[MAX_STR_BUF_LEN + 1];
+
+		if (!targets[i].up)
+			continue;
+
+		fputs("hpsahba_controller_info{", file);
+		fprint_target_labels(file, &targets[i]);
+		copy_str_buf(str, controller_id->vendor_id, VENDOR_ID_LEN);
+		fputc(',', file);
+		fprint_label(file, "vendor_id", str);
+		copy_str_buf(str, controller_id->product_id, PRODUCT_ID_LEN);
+		fputc(',', file);
+		fprint_label(file, "product_id", str);
+		copy_str_buf(str, controller_id->running_firm_rev,
+			FIRMWARE_REV_LEN);
+		fputc(',', file);
+		fprint_label(file, "running_firm_rev", str);
+		copy_str_buf(str, controller_id->rom_firm_rev,
+			FIRMWARE_REV_LEN);
+		fputc(',', file);
+		fprint_label(file, "rom_firm_rev", str);
+		fputs("} 1\n", file);
+	}
+}
+
+/*
+ * Replace file atomically, so collector never reads partial output. Failure
+ * is not fatal, previous file stays in place until the next poll.
+ */
+static void write_metrics(const char *out_path,
+	const struct export_target targets[], size_t num_targets)
+{
+	unsigned long (*values)[NUM_METRICS];
+	char *tmp_path;
+	FILE *file;
+
+	values = calloc(num_targets, sizeof(*values));
+	if (values == NULL)
+		die("Out of memory");
+	for (size_t i = 0; i < num_targets; i++)
+		if (targets[i].up)
+			collect_metrics(values[i], &targets[i].controller_id,
+				&targets[i].controller_params);
+
+	tmp_path = malloc(strlen(out_path) + sizeof(".tmp"));
+	if (tmp_path == NULL)
+		die("Out of memory");
+	strcpy(tmp_path, out_path);
+	strcat(tmp_path, ".tmp");
+	file = fopen(tmp_path, "w");
+	if (file == NULL) {
+		warn_dev_errno(tmp_path, "Unable to open metrics file");
+		goto out;
+	}
+
+	fputs("# HELP hpsahba_up Whether the last poll of controller succeeded.\n"
+		"# TYPE hpsahba_up gauge\n",
+		file);
+	for (size_t i = 0; i < num_targets; i++) {
+		fputs("hpsahba_up{", file);
+		fprint_target_labels(file, &targets[i]);
+		fprintf(file, "} %d\n", targets[i].up);
+	}
+	fprint_info_metric(file, targets, num_targets);
+	for (int m = 0; m < NUM_METRICS; m++) {
+		fprintf(file, "# HELP %s %s\n# TYPE %s gauge\n",
+			metrics[m].name, metrics[m].help, metrics[m].name);
+		for (size_t i = 0; i < num_targets; i++) {
+			if (!targets[i].up)
+				continue;
+			fprintf(file, "%s{", metrics[m].name);
+			fprint_target_labels(file, &targets[i]);
+			fprintf(file, "} %lu\n", values[i][m]);
+		}
+	}
+	fprintf(file,
+		"# HELP hpsahba_last_update_timestamp_seconds "
+			"Time of the last poll of controllers.\n"
+		"# TYPE hpsahba_last_update_timestamp_seconds gauge\n"
+		"hpsahba_last_update_timestamp_seconds %lld\n",
+		(long long)time(NULL));
+
+	if (ferror(file)) {
+		warn_dev(tmp_path, "Unable to write metrics file");
+		fclose(file);
+		goto err;
+	}
+	if (fclose(file)) {
+		warn_dev_errno(tmp_path, "Unable to close metrics file");
+		goto err;
+	}
+	if (rename(tmp_path, out_path)) {
+		warn_dev_errno(tmp_path, "Unable to rename metrics file to %s",
+			out_path);
+		goto err;
+	}
+	goto out;
+
+err:
+	if (unlink(tmp_path))
+		warn_dev_errno(tmp_path, "Unable to remove metrics file");
+out:
+	free(tmp_path);
+	free(values);
+}
+
+/*
+ * Keep devices open and send one round of commands to each controller per
+ * interval. Metrics are served from the file between polls. Controller which
+ * fails to answer is reported with hpsahba_up 0 and its values are left out
+ * until the next poll.
+ */
+static void export_metrics(const char *out_path, char *const dev_paths[],
+	int num_dev_paths, unsigned int interval)
+{
+	struct export_target *targets;
+
+	targets = calloc(num_dev_paths, sizeof(*targets));
+	if (targets == NULL)
+		die("Out of memory");
+
+	for (int i = 0; i < num_dev_paths; i++) {
+		targets[i].path = dev_paths[i];
+		targets[i].fd = open_dev(targets[i].path);
+	}
+
+	for (;;) {
+		for (int i = 0; i < num_dev_paths; i++) {
+			struct export_target *target = &targets[i];
+
+			/* Keys do not change, they are read only once. */
+			target->up = !poll_controller(target->path, target->fd,
+				&target->controller_id,
+				&target->controller_params,
+				&target->keys, &target->keys_valid);
+		}
+
+		/* Written again on the next poll if it fails. */
+		write_metrics(out_path, targets, num_dev_paths);
+
+		sleep(interval);
+	}
 }
 
 static void verify_hba_mode(const char *path, int fd, int should_be_enabled)
@@ -396,6 +1281,11 @@ static void verify_hba_mode(const char *path, int fd, int should_be_enabled)
 	}
 }
 
+/*
+ * hpsa usually runs the scan inside of this ioctl, but it returns without
+ * scanning if another scan is already waiting, if reset is in progress (scan
+ * is only requested then) or if controller is locked up.
+ */
 static void rescan_scsi(const char *path, int fd)
 {
 	int rc = ioctl(fd, CCISS_REGNEWD);
@@ -404,25 +1294,406 @@ static void rescan_scsi(const char *path, int fd)
 			"ioctl(CCISS_REGNEWD) failed, rc == %d", rc);
 }
 
-static void change_hba_mode(const char *path, int fd, int enabled)
+static void apply_hba_mode(const char *path, int fd,
+	struct bmic_controller_parameters *controller_params, int enabled)
+{
+	fill_hba_mode(controller_params, enabled);
+	set_controller_parameters(path, fd, controller_params);
+
+	verify_hba_mode(path, fd, enabled);
+
+	rescan_scsi(path, fd);
+}
+
+static void change_hba_mode(const char *path, int fd, int enabled,
+	const struct confirm_tokens *tokens)
 {
 	struct bmic_identify_controller controller_id = {0};
 	struct bmic_controller_parameters controller_params = {0};
+	struct controller_keys keys;
+	int lock_fd;
 
-	ask_user_confirmation();
-
+	lock_fd = lock_controller_shared(path, fd);
 	identify_controller(path, fd, &controller_id);
+	/* Keys are needed only to match confirmation tokens. */
+	if (tokens->num_tokens)
+		get_controller_keys(path, fd, &controller_id, &keys);
+	unlock_controller(path, lock_fd);
+
+	if (!tokens->num_tokens || !is_change_confirmed(tokens, path, &keys))
+		ask_user_confirmation();
+
+	/* Nobody should change parameters between sense and set. */
+	lock_fd = lock_controller(path, fd, 1);
 	sense_controller_parameters(path, fd, &controller_params);
 
 	if (!is_hba_mode_supported(&controller_id))
 		die_dev(path, "HBA mode is not supported on this controller");
 
-	fill_hba_mode(&controller_params, enabled);
-	set_controller_parameters(path, fd, &controller_params);
+	apply_hba_mode(path, fd, &controller_params, enabled);
+	unlock_controller(path, lock_fd);
+}
 
-	verify_hba_mode(path, fd, enabled);
+enum plan_match_key {
+	PLAN_MATCH_BOARD_ID,
+	PLAN_MATCH_PCI_ADDRESS,
+	PLAN_MATCH_SERIAL_NUMBER,
 
-	rescan_scsi(path, fd);
+	PLAN_MATCH_UNKNOWN,
+};
+
+struct plan_entry {
+	unsigned int line_num;
+	enum plan_match_key match_key;
+	uint32_t board_id;
+	char match_str[MAX_STR_BUF_LEN + 1];
+	int hba_mode_enabled;
+};
+
+struct plan {
+	struct plan_entry *entries;
+	size_t num_entries;
+};
+
+static void set_plan_match_key(const char *path, struct plan_entry *entry,
+	enum plan_match_key match_key)
+{
+	if (entry->match_key != PLAN_MATCH_UNKNOWN)
+		die_file_line(path, entry->line_num,
+			"More than one controller selector in plan entry");
+	entry->match_key = match_key;
+}
+
+static void set_plan_match_str(const char *path, struct plan_entry *entry,
+	const char *value, size_t max_len)
+{
+	if (!*value || strlen(value) > max_len)
+		die_file_line(path, entry->line_num,
+			"Invalid controller selector value: '%s'", value);
+	strcpy(entry->match_str, value);
+}
+
+static void parse_plan_token(const char *path, struct plan_entry *entry,
+	char *token, int *hba_mode_set)
+{
+	char *value = strchr(token, '=');
+	char *end;
+	unsigned long board_id;
+
+	if (value == NULL)
+		die_file_line(path, entry->line_num,
+			"Expected key=value, got '%s'", token);
+	*value++ = '\0';
+
+	if (!strcmp(token, "board_id")) {
+		set_plan_match_key(path, entry, PLAN_MATCH_BOARD_ID);
+		errno = 0;
+		board_id = strtoul(value, &end, 16);
+		if (errno || !*value || *end || board_id > UINT32_MAX)
+			die_file_line(path, entry->line_num,
+				"Invalid board_id: '%s'", value);
+		entry->board_id = board_id;
+	} else if (!strcmp(token, "pci_address")) {
+		set_plan_match_key(path, entry, PLAN_MATCH_PCI_ADDRESS);
+		set_plan_match_str(path, entry, value, PCI_ADDRESS_LEN);
+	} else if (!strcmp(token, "serial_number")) {
+		set_plan_match_key(path, entry, PLAN_MATCH_SERIAL_NUMBER);
+		set_plan_match_str(path, entry, value, SERIAL_NUMBER_LEN);
+	} else if (!strcmp(token, "hba_mode")) {
+		if (*hba_mode_set)
+			die_file_line(path, entry->line_num,
+				"More than one hba_mode in plan entry");
+		if (!strcmp(value, "enabled"))
+			entry->hba_mode_enabled = 1;
+		else if (!strcmp(value, "disabled"))
+			entry->hba_mode_enabled = 0;
+		else
+			die_file_line(path, entry->line_num,
+				"Invalid hba_mode: '%s', expected 'enabled' "
+				"or 'disabled'",
+				value);
+		*hba_mode_set = 1;
+	} else {
+		die_file_line(path, entry->line_num,
+			"Unknown key: '%s'", token);
+	}
+}
+
+static void read_plan(const char *path, struct plan *plan)
+{
+	FILE *file;
+	char *line = NULL;
+	size_t line_size = 0;
+	unsigned int line_num = 0;
+
+	file = fopen(path, "r");
+	if (file == NULL)
+		die_errno("%s: Unable to open plan file", path);
+
+	while (getline(&line, &line_size, file) != -1) {
+		struct plan_entry entry = {0};
+		char *token;
+		char *saveptr;
+		int hba_mode_set = 0;
+
+		line_num++;
+
+		strip_comment(line);
+		token = strtok_r(line, CONF_DELIMITERS, &saveptr);
+		if (token == NULL)
+			/* Empty line or comment. */
+			continue;
+
+		entry.line_num = line_num;
+		entry.match_key = PLAN_MATCH_UNKNOWN;
+		while (token != NULL) {
+			parse_plan_token(path, &entry, token, &hba_mode_set);
+			token = strtok_r(NULL, CONF_DELIMITERS, &saveptr);
+		}
+
+		if (entry.match_key == PLAN_MATCH_UNKNOWN)
+			die_file_line(path, line_num,
+				"No board_id, pci_address or serial_number in "
+				"plan entry");
+		if (!hba_mode_set)
+			die_file_line(path, line_num, "No hba_mode in plan entry");
+
+		plan->entries = realloc(plan->entries,
+			(plan->num_entries + 1) * sizeof(*plan->entries));
+		if (plan->entries == NULL)
+			die("Out of memory");
+		plan->entries[plan->num_entries++] = entry;
+	}
+	if (ferror(file))
+		die_errno("%s: Unable to read plan file", path);
+
+	free(line);
+	fclose(file);
+}
+
+static int plan_entry_matches(const struct plan_entry *entry,
+	const struct controller_keys *keys)
+{
+	switch (entry->match_key) {
+	case PLAN_MATCH_BOARD_ID:
+		return entry->board_id == keys->board_id;
+	case PLAN_MATCH_PCI_ADDRESS:
+		return !strcasecmp(entry->match_str, keys->pci_address);
+	case PLAN_MATCH_SERIAL_NUMBER:
+		return !strcmp(entry->match_str, keys->serial_number);
+	default:
+		/* Should never happen. */
+		assert(0);
+	}
+
+	return 0;
+}
+
+/*
+ * Entries selecting one controller (pci_address, serial_number) take
+ * precedence over board_id, which usually selects a whole model. First
+ * matching entry wins within each group, but two matching entries of the
+ * first group must agree on hba_mode.
+ */
+static const struct plan_entry *find_plan_entry(const struct plan *plan,
+	const char *path, const struct controller_keys *keys)
+{
+	const struct plan_entry *found = NULL;
+
+	for (size_t i = 0; i < plan->num_entries; i++) {
+		const struct plan_entry *entry = &plan->entries[i];
+
+		if (entry->match_key == PLAN_MATCH_BOARD_ID ||
+				!plan_entry_matches(entry, keys))
+			continue;
+
+		if (found == NULL)
+			found = entry;
+		else if (found->hba_mode_enabled != entry->hba_mode_enabled)
+			die_dev(path,
+				"Plan lines %u and %u select this controller "
+				"with different hba_mode",
+				found->line_num, entry->line_num);
+	}
+	if (found != NULL)
+		return found;
+
+	for (size_t i = 0; i < plan->num_entries; i++) {
+		const struct plan_entry *entry = &plan->entries[i];
+
+		if (entry->match_key == PLAN_MATCH_BOARD_ID &&
+				plan_entry_matches(entry, keys))
+			return entry;
+	}
+
+	return NULL;
+}
+
+struct apply_target {
+	const char *path;
+	int fd;
+	struct controller_keys keys;
+	struct bmic_controller_parameters controller_params;
+	int hba_mode_enabled;
+	pid_t pid;
+};
+
+static const char *hba_mode_str(int enabled)
+{
+	return enabled ? "enabled" : "disabled";
+}
+
+/*
+ * Returns 1 if controller needs change and fills target, 0 if controller
+ * should be skipped.
+ */
+static int plan_target(const struct plan *plan, const char *path,
+	struct apply_target *target)
+{
+	struct bmic_identify_controller controller_id = {0};
+	const struct plan_entry *entry;
+	int fd = open_dev(path);
+	int lock_fd = lock_controller_shared(path, fd);
+
+	identify_controller(path, fd, &controller_id);
+	get_controller_keys(path, fd, &controller_id, &target->keys);
+
+	entry = find_plan_entry(plan, path, &target->keys);
+	if (entry == NULL) {
+		printf("%s: No matching plan entry, skipping\n", path);
+		unlock_controller(path, lock_fd);
+		close_dev(path, fd);
+		return 0;
+	}
+
+	if (!is_hba_mode_supported(&controller_id))
+		die_dev(path,
+			"HBA mode is not supported on this controller "
+			"(plan line %u)",
+			entry->line_num);
+
+	sense_controller_parameters(path, fd, &target->controller_params);
+	unlock_controller(path, lock_fd);
+	if (is_hba_mode_enabled(&target->controller_params) ==
+			entry->hba_mode_enabled) {
+		printf("%s: HBA mode already %s, skipping\n",
+			path, hba_mode_str(entry->hba_mode_enabled));
+		close_dev(path, fd);
+		return 0;
+	}
+
+	printf("%s: HBA mode will be %s (plan line %u)\n",
+		path, hba_mode_str(entry->hba_mode_enabled), entry->line_num);
+	target->path = path;
+	target->fd = fd;
+	target->hba_mode_enabled = entry->hba_mode_enabled;
+	return 1;
+}
+
+/* Runs in child process, one per controller. */
+static void apply_target_hba_mode(struct apply_target *target)
+{
+	int lock_fd = lock_controller(target->path, target->fd, 1);
+
+	/* Parameters may have changed while plan was confirmed. */
+	sense_controller_parameters(target->path, target->fd,
+		&target->controller_params);
+	if (is_hba_mode_enabled(&target->controller_params) ==
+			target->hba_mode_enabled)
+		fprintf(stderr, "%s: HBA mode already %s by someone else\n",
+			target->path, hba_mode_str(target->hba_mode_enabled));
+	else
+		apply_hba_mode(target->path, target->fd,
+			&target->controller_params,
+			target->hba_mode_enabled);
+
+	unlock_controller(target->path, lock_fd);
+}
+
+static void apply_plan(const char *plan_path, char *const dev_paths[],
+	int num_dev_paths, const struct confirm_tokens *tokens)
+{
+	struct plan plan = {NULL, 0};
+	struct apply_target *targets;
+	size_t num_targets = 0;
+	unsigned int num_failed = 0;
+	int confirmed = 1;
+
+	read_plan(plan_path, &plan);
+
+	targets = calloc(num_dev_paths, sizeof(*targets));
+	if (targets == NULL)
+		die("Out of memory");
+
+	for (int i = 0; i < num_dev_paths; i++) {
+		struct apply_target *target = &targets[num_targets];
+
+		if (!plan_target(&plan, dev_paths[i], target))
+			continue;
+
+		for (size_t j = 0; j < num_targets; j++)
+			if (!strcmp(targets[j].keys.pci_address,
+					target->keys.pci_address))
+				die_dev(target->path,
+					"Same controller as %s",
+					targets[j].path);
+		num_targets++;
+	}
+
+	if (num_targets == 0) {
+		printf("Nothing to change\n");
+		goto out;
+	}
+
+	/* Ask once if at least one controller is not confirmed by token. */
+	for (size_t i = 0; i < num_targets; i++)
+		if (!is_change_confirmed(tokens, targets[i].path,
+				&targets[i].keys))
+			confirmed = 0;
+	if (!confirmed)
+		ask_user_confirmation();
+
+	/* Do not let children flush buffered output of parent. */
+	fflush(stdout);
+	fflush(stderr);
+
+	for (size_t i = 0; i < num_targets; i++) {
+		struct apply_target *target = &targets[i];
+
+		target->pid = fork();
+		if (target->pid == -1)
+			die_errno("fork() failed");
+		if (target->pid == 0) {
+			apply_target_hba_mode(target);
+			exit(0);
+		}
+	}
+
+	for (size_t i = 0; i < num_targets; i++) {
+		struct apply_target *target = &targets[i];
+		int status;
+
+		if (waitpid(target->pid, &status, 0) == -1)
+			die_errno("waitpid() failed");
+
+		if (WIFEXITED(status) && WEXITSTATUS(status) == 0) {
+			printf("%s: HBA mode %s\n", target->path,
+				hba_mode_str(target->hba_mode_enabled));
+		} else {
+			fprintf(stderr, "%s: HBA mode change failed\n",
+				target->path);
+			num_failed++;
+		}
+
+		close_dev(target->path, target->fd);
+	}
+
+	if (num_failed)
+		die("HBA mode change failed on %u controller(s)", num_failed);
+
+out:
+	free(targets);
+	free(plan.entries);
 }
 
 enum cli_action {
@@ -431,6 +1702,9 @@ enum cli_action {
 	ACTION_INFO,
 	ACTION_ENABLE,
 	ACTION_DISABLE,
+	ACTION_APPLY,
+	ACTION_WATCH,
+	ACTION_EXPORT,
 
 	ACTION_UNKNOWN,
 };
@@ -447,11 +1721,17 @@ int main(int argc, char *argv[])
 	int opt = 0;
 	enum cli_action action = ACTION_UNKNOWN;
 	const char *path = NULL;
+	const char *plan_path = NULL;
+	unsigned int interval = 0;
+	const char *export_path = NULL;
+	unsigned int export_interval = 0;
+	struct confirm_tokens confirm_tokens = {NULL, 0};
+	struct confirm_token confirm_token;
 	int fd = -1;
 
 	opterr = 0;
 	while (opt != -1) {
-		opt = getopt(argc, argv, ":hvi:E:d:");
+		opt = getopt(argc, argv, ":hvi:E:d:a:c:w:p:n:");
 
 		switch (opt) {
 		case -1:
@@ -475,6 +1755,28 @@ int main(int argc, char *argv[])
 			set_action(&action, ACTION_DISABLE);
 			path = optarg;
 			break;
+		case 'a':
+			set_action(&action, ACTION_APPLY);
+			plan_path = optarg;
+			break;
+		case 'w':
+			set_action(&action, ACTION_WATCH);
+			interval = parse_interval(optarg);
+			break;
+		case 'p':
+			set_action(&action, ACTION_EXPORT);
+			export_path = optarg;
+			break;
+		case 'n':
+			export_interval = parse_interval(optarg);
+			break;
+		case 'c':
+			if (parse_confirm_token(optarg, &confirm_token))
+				die("Invalid confirmation token: '%s', try "
+					"running with -h",
+					optarg);
+			add_confirm_token(&confirm_tokens, &confirm_token);
+			break;
 		case '?':
 			die("Unknown command line option: '%c', try running "
 				"with -h",
@@ -488,8 +1790,47 @@ int main(int argc, char *argv[])
 		}
 	}
 
-	if (argc > optind)
-		die("Invalid argument in command line, try running with -h");
+	switch (action) {
+	case ACTION_APPLY:
+		if (argc == optind)
+			die("No device paths to apply plan to, try running "
+				"with -h");
+		break;
+	case ACTION_EXPORT:
+		if (argc == optind)
+			die("No device paths to export metrics for, try "
+				"running with -h");
+		break;
+	case ACTION_WATCH:
+		if (argc - optind != 1)
+			die("Exactly one device path required for '-w', try "
+				"running with -h");
+		path = argv[optind];
+		break;
+	default:
+		if (argc > optind)
+			die("Invalid argument in command line, try running "
+				"with -h");
+	}
+
+	switch (action) {
+	case ACTION_ENABLE:
+	case ACTION_DISABLE:
+	case ACTION_APPLY:
+		read_confirm_policy(&confirm_tokens);
+		break;
+	default:
+		if (confirm_tokens.num_tokens)
+			die("Option '-c' is valid only with '-E', '-d' or "
+				"'-a', try running with -h");
+	}
+
+	if (action == ACTION_EXPORT) {
+		if (export_interval == 0)
+			export_interval = DEFAULT_EXPORT_INTERVAL;
+	} else if (export_interval) {
+		die("Option '-n' is valid only with '-p', try running with -h");
+	}
 
 	if (path != NULL)
 		fd = open_dev(path);
@@ -505,10 +1846,21 @@ int main(int argc, char *argv[])
 		print_info(path, fd);
 		break;
 	case ACTION_ENABLE:
-		change_hba_mode(path, fd, 1);
+		change_hba_mode(path, fd, 1, &confirm_tokens);
 		break;
 	case ACTION_DISABLE:
-		change_hba_mode(path, fd, 0);
+		change_hba_mode(path, fd, 0, &confirm_tokens);
+		break;
+	case ACTION_APPLY:
+		apply_plan(plan_path, argv + optind, argc - optind,
+			&confirm_tokens);
+		break;
+	case ACTION_WATCH:
+		watch_info(path, fd, interval);
+		break;
+	case ACTION_EXPORT:
+		export_metrics(export_path, argv + optind, argc - optind,
+			export_interval);
 		break;
 	default:
 		die("No option selected, try running with -h");
@@ -517,5 +1869,7 @@ int main(int argc, char *argv[])
 	if (fd != -1)
 		close_dev(path, fd);
 
+	free(confirm_tokens.tokens);
+
 	return 0;
 }